@@ -2,10 +2,11 @@
 
 set -xe
 
-compileFlags="-Wall -Wpedantic -Wextra -Wconversion -Wshadow -Wsign-conversion -Wcast-align -pedantic -std=c++17 -lssl -lcrypto"
+compileFlags="-Wall -Wpedantic -Wextra -Wconversion -Wshadow -Wsign-conversion -Wcast-align -pedantic -std=c++17"
+libs="-lssl -lcrypto -lz"
 
 g++ -c common/utils.cpp -o utils
 # shellcheck disable=SC2086
 g++ $compileFlags utils tracker/tracker.cpp -o tracker.out
 # shellcheck disable=SC2086
-g++ $compileFlags utils client/client.cpp -o client.out
+g++ $compileFlags utils client/client.cpp -o client.out $libs
@@ -1,45 +1,453 @@
 #include "../common/utils.hpp"
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <errno.h>
 #include <fcntl.h>
+#include <future>
+#include <ifaddrs.h>
 #include <iomanip>
 #include <iostream>
 #include <libgen.h>
+#include <linux/fs.h>
+#include <memory>
+#include <mutex>
 #include <openssl/evp.h>
+#include <poll.h>
+#include <random>
+#include <set>
 #include <string>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <thread>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
+#include <zlib.h>
 
 using namespace std;
 
 #define LOG_LEVEL 2
 #define CHUNK_SIZE 512
 #define TRACKERS 2
-#define PIECE_SIZE 524288 // 512 KB; 512 * 1024 bytes
+#define PIECE_SIZE 524288                    // 512 KB; 512 * 1024 bytes
+#define REFRESH_INTERVAL 64                  // pieces downloaded between peer list refreshes from the tracker
+#define MAX_IDLE_ROUNDS 10                   // idle rounds, of a second at least, before giving up
+#define PIECE_CACHE_BYTES (64 * PIECE_SIZE)  // memory a seeder may spend on recently served pieces
+#define PIECE_CACHE_AGING 1024               // cache lookups between halvings of the piece frequencies
+#define PEER_CONNECT_TIMEOUT_MS 3000         // deadline for connecting to a peer
+#define PEER_IO_TIMEOUT_SECS 10              // a connected peer silent for this long is dropped
+#define TRACKER_CONNECT_TIMEOUT_MS 5000      // deadline for connecting to a tracker
+#define MAX_PEERS 40                         // peers a download keeps connections to at once
+#define PEER_BLACKLIST_SECS 4                // how long a peer that failed is not dialed again
+#define EWMA_WEIGHT 0.25                     // weight of the newest sample in the peer rtt and throughput averages
+#define RAREST_TIES 8                        // equally rare pieces compared by their best holder when picking
+#define EXPLORE_PERCENT 10                   // share of piece requests sent to a random holder instead of the best
+#define STREAM_WINDOW 16                     // pieces ahead of the stream position that are fetched in order
+#define POOL_BUFFER_SIZE (PIECE_SIZE + 4096) // a piece, or a compressed piece that came out slightly larger
+#define PIECE_POOL_BUFFERS 128               // caps piece buffer memory at 64 MB + slack, including the piece cache
+#define HEARTBEAT_SECS 10                    // idle time between heartbeats; the tracker drops holders after 30 s
+
+// a holder that failed once, e.g. with a passing read error, must be retried before the download gives up on it
+static_assert(PEER_BLACKLIST_SECS * 2 <= MAX_IDLE_ROUNDS, "blacklist outlasts the idle rounds of a download");
+
+struct Peer {
+  int sock = -1;     // connection held by the downloader, -1 if not connected yet
+  string path;       // file path on the peer, as reported by the tracker
+  vector<bool> have; // piece -> present on the peer
+  bool counted = false; // have is included in File::avail
+};
 
 struct File {
   __off_t size;
+  time_t mtime;
   vector<string> hashes;
   string hash;
   int fd;
   size_t rem;
   string path;
   bool open;
+  bool compress;                     // ask peers for compressed pieces
+  bool stream;                       // emit the file in order while it downloads
+  string stream_path;                // where to emit it; not stdout, which the prompt and the logs write to
+  int stream_fd;
+  size_t next_emit;                  // first piece not emitted yet
+  string root;                       // merkle root; if set, piece hashes are learnt from the proofs sent with pieces
+  vector<vector<string>> tree;       // merkle levels, leaves first; "" where a node is not known yet
+  vector<bool> have;                 // piece -> present locally
+  vector<size_t> avail;              // piece -> connected peers holding it; only kept while downloading
+  set<pair<size_t, size_t>> rarest;  // (avail, piece) of the missing pieces that a connected peer holds
+  unordered_map<string, Peer> peers; // peer address -> swarm view; only kept while downloading
+};
+
+unordered_map<string, File> files;        // file-hash -> File; one piece store however many groups share it
+unordered_map<string, string> groupFiles; // group::file-name -> file-hash
+mutex files_mtx;                          // guards files, groupFiles, File::have and File::peers
+unordered_map<string, thread> streamers;  // file-hash -> emitter of a streaming download; guarded by files_mtx
+condition_variable emit_cv;               // signalled when a download gets a piece or stops streaming
+string self_addr;
+set<uint32_t> local_ips; // addresses of this host's interfaces
+// how a peer has been serving us, across all downloads
+struct PeerStats {
+  double rtt = 0;        // EWMA of the time to the reply of a piece request, seconds
+  double throughput = 0; // EWMA of piece bytes per second
+  size_t inflight = 0;   // piece requests currently outstanding
+  bool sampled = false;
+  double score();
 };
 
-unordered_map<string, File> groupFiles; // group, file-name -> File
+unordered_map<string, PeerStats> peerStats; // peer address -> PeerStats
+mutex stats_mtx;
+unordered_map<string, chrono::steady_clock::time_point> failedPeers; // peer address -> end of its blacklisting
+mutex blacklist_mtx;
+
+string hash_to_hex(unsigned char *hash, unsigned int hash_len) {
+  stringstream ss;
+  for (unsigned int i = 0; i < hash_len; i++) ss << hex << setw(2) << setfill('0') << (int)hash[i];
+  return ss.str();
+}
+
+string sha1_hex(const char *buf, size_t len) {
+  unsigned char hash[EVP_MAX_MD_SIZE];
+  unsigned int hash_len = 0;
+  EVP_Digest(buf, len, hash, &hash_len, EVP_sha1(), nullptr);
+  return hash_to_hex(hash, hash_len);
+}
+
+// Merkle mode: leaves are the piece hashes, a parent is the hash of its children's hex digests concatenated, and a node
+// left without a sibling is carried up a level unchanged. A proof lists the sibling hashes from a leaf up to the root.
+string merkle_parent(const string &left, const string &right) {
+  string both = left + right;
+  return sha1_hex(both.data(), both.size());
+}
+
+vector<vector<string>> merkle_tree(vector<string> leaves) {
+  vector<vector<string>> tree{leaves};
+  while (tree.back().size() > 1) {
+    vector<string> level;
+    for (size_t i = 0; i < tree.back().size(); i += 2)
+      level.push_back(i + 1 < tree.back().size() ? merkle_parent(tree.back()[i], tree.back()[i + 1]) : tree.back()[i]);
+    tree.push_back(level);
+  }
+  return tree;
+}
+
+// a tree with no known nodes, filled in from the proofs of the pieces as they arrive
+vector<vector<string>> merkle_shape(size_t count) {
+  vector<vector<string>> tree{vector<string>(count)};
+  while (tree.back().size() > 1) tree.push_back(vector<string>((tree.back().size() + 1) / 2));
+  return tree;
+}
+
+// false if a sibling on the way up is not known
+bool merkle_proof(const vector<vector<string>> &tree, size_t piece, string &proof) {
+  proof.clear();
+  size_t i = piece;
+  for (size_t level = 0; level + 1 < tree.size(); level++, i /= 2) {
+    if ((i ^ 1) >= tree[level].size()) continue;
+    if (tree[level][i ^ 1].empty()) return false;
+    proof += (proof.empty() ? "" : ",") + tree[level][i ^ 1];
+  }
+  return true;
+}
+
+// checks a leaf against the root; on success records the path and its siblings, so the piece can be served with a
+// proof in turn
+bool merkle_verify(vector<vector<string>> &tree, string root, size_t piece, string leaf, string proof) {
+  vector<string> siblings = proof.empty() ? vector<string>() : split(proof, ',');
+  vector<string> path{leaf};
+  size_t i = piece, k = 0;
+  for (size_t level = 0; level + 1 < tree.size(); level++, i /= 2) {
+    if ((i ^ 1) < tree[level].size()) {
+      if (k == siblings.size()) return false;
+      path.push_back(i % 2 ? merkle_parent(siblings[k], path.back()) : merkle_parent(path.back(), siblings[k]));
+      k++;
+    } else {
+      path.push_back(path.back());
+    }
+  }
+  if (path.back() != root or k != siblings.size()) return false;
+  i = piece;
+  k = 0;
+  for (size_t level = 0; level < tree.size(); level++, i /= 2) {
+    tree[level][i] = path[level];
+    if (level + 1 < tree.size() and (i ^ 1) < tree[level].size()) tree[level][i ^ 1] = siblings[k++];
+  }
+  return true;
+}
+
+string encode_bitfield(const vector<bool> &have) {
+  const char *digits = "0123456789abcdef";
+  string res((have.size() + 3) / 4, '0');
+  for (size_t i = 0; i < res.size(); i++) {
+    int nibble = 0;
+    for (size_t j = 0; j < 4 and i * 4 + j < have.size(); j++)
+      if (have[i * 4 + j]) nibble |= 8 >> j;
+    res[i] = digits[nibble];
+  }
+  return res;
+}
+
+vector<bool> decode_bitfield(const string &bits, size_t count) {
+  vector<bool> res(count, false);
+  for (size_t i = 0; i < bits.size() and i * 4 < count; i++) {
+    int nibble = (int)strtol(string(1, bits[i]).c_str(), nullptr, 16);
+    for (size_t j = 0; j < 4 and i * 4 + j < count; j++) res[i * 4 + j] = nibble & (8 >> j);
+  }
+  return res;
+}
+
+// File::avail and File::rarest follow the bitfields of the connected peers as they change, so that picking a piece
+// does not rescan the swarm. Called with files_mtx held
+void set_avail(File &f, size_t piece, size_t n) {
+  if (not f.have[piece] and f.avail[piece]) f.rarest.erase({f.avail[piece], piece});
+  f.avail[piece] = n;
+  if (not f.have[piece] and n) f.rarest.insert({n, piece});
+}
+
+// adds a connected peer's pieces to the availability counts, or takes them out
+void count_peer(File &f, Peer &p, bool add) {
+  if (p.counted == add or (add and p.sock < 0)) return;
+  for (size_t i = 0; i < p.have.size() and i < f.avail.size(); i++)
+    if (p.have[i]) set_avail(f, i, add ? f.avail[i] + 1 : f.avail[i] - 1);
+  p.counted = add;
+}
+
+void mark_have(File &f, size_t piece) {
+  if (f.avail[piece]) f.rarest.erase({f.avail[piece], piece});
+  f.have[piece] = true;
+}
+
+BufferPool piecePool(POOL_BUFFER_SIZE, PIECE_POOL_BUFFERS); // buffers for every piece read, send, receive and write
+
+// Pieces recently served to other peers, so that rarest-first downloaders asking for the same piece at about the same
+// time do not each cost a disk read. Bounded by PIECE_CACHE_BYTES of pool buffers; the least frequently requested
+// piece is evicted first, and frequencies are halved every PIECE_CACHE_AGING lookups so that pieces that were hot long
+// ago age out.
+struct PieceCache {
+  struct Entry {
+    PoolBuf raw;
+    PoolBuf z;           // zlib form; empty if the piece does not compress or has not been asked for compressed
+    bool z_known = false;
+    size_t freq = 0;
+  };
+  mutex mtx;
+  unordered_map<string, Entry> entries; // "file-hash piece" -> Entry
+  size_t used = 0;                      // bytes of the pool buffers held by entries
+  size_t lookups = 0;
+  size_t hits = 0;
+  size_t misses = 0;
+
+  void touch(Entry &e) {
+    e.freq++;
+    if (++lookups % PIECE_CACHE_AGING == 0)
+      for (auto &x : entries) x.second.freq /= 2;
+  }
+
+  // the cached piece, or an empty PoolBuf on a miss
+  PoolBuf get(string key) {
+    lock_guard<mutex> lock(mtx);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+      misses++;
+      return PoolBuf();
+    }
+    hits++;
+    touch(it->second);
+    return it->second.raw;
+  }
+
+  // true if it is known whether the piece compresses; z is its compressed form, or null if it does not compress
+  bool get_compressed(string key, PoolBuf &z) {
+    lock_guard<mutex> lock(mtx);
+    auto it = entries.find(key);
+    if (it == entries.end() or not it->second.z_known) return false;
+    z = it->second.z;
+    if (z.data) { // an incompressible piece is counted when its raw form is looked up
+      hits++;
+      touch(it->second);
+    }
+    return true;
+  }
+
+  void put(string key, PoolBuf raw) {
+    lock_guard<mutex> lock(mtx);
+    if (entries.find(key) != entries.end()) return;
+    while (used + piecePool.buf_size > PIECE_CACHE_BYTES and not entries.empty()) evict();
+    used += piecePool.buf_size;
+    entries[key].raw = raw;
+    entries[key].freq = 1;
+  }
+
+  void put_compressed(string key, PoolBuf z) {
+    lock_guard<mutex> lock(mtx);
+    auto it = entries.find(key);
+    if (it == entries.end() or it->second.z_known) return;
+    it->second.z_known = true;
+    if (not z.data) return;
+    while (used + piecePool.buf_size > PIECE_CACHE_BYTES and entries.size() > 1) evict(key);
+    it->second.z = z;
+    used += piecePool.buf_size;
+  }
+
+  // drops the least frequently used entry other than keep
+  void evict(const string &keep = "") {
+    auto coldest = entries.end();
+    for (auto it = entries.begin(); it != entries.end(); it++)
+      if (it->first != keep and (coldest == entries.end() or it->second.freq < coldest->second.freq)) coldest = it;
+    used -= piecePool.buf_size * (coldest->second.z.data ? 2 : 1);
+    entries.erase(coldest);
+  }
+
+  string stats() {
+    lock_guard<mutex> lock(mtx);
+    return sprint("hits:", hits, "misses:", misses, "pieces:", entries.size(), "bytes:", used);
+  }
+};
+
+PieceCache pieceCache;
+
+// compresses a piece into a pool buffer; z is left empty if the piece does not shrink enough to be worth sending
+// compressed. Returns false, without waiting, if no pool buffer is free: the caller already holds the raw piece and
+// can send that instead
+bool compress_piece(const PoolBuf &buf, PoolBuf &z) {
+  PoolBuf out = piecePool.try_acquire();
+  if (not out.data) return false;
+  uLongf z_len = piecePool.buf_size;
+  if (compress2((Bytef *)out.get(), &z_len, (const Bytef *)buf.get(), buf.size, Z_BEST_SPEED) != Z_OK or
+      z_len > buf.size - buf.size / 8)
+    return true; // already compressed data; sending it raw saves the receiver a pointless inflate
+  out.size = z_len;
+  z = out;
+  return true;
+}
+
+// reads a piece from disk, going through the piece cache; returns an empty PoolBuf on failure
+PoolBuf read_piece(string key, string path, size_t piece) {
+  PoolBuf cached = pieceCache.get(key);
+  if (cached.data) return cached;
+
+  log_info("opening", path, "for sharing");
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    log_error("could not open file for sharing");
+    return PoolBuf();
+  }
+  PoolBuf buf = piecePool.acquire();
+  ssize_t n_bytes = pread(fd, buf.get(), PIECE_SIZE, (__off_t)(piece * PIECE_SIZE));
+  close(fd);
+  if (n_bytes < 0) {
+    log_error("error reading file", strerror(errno));
+    return PoolBuf();
+  }
+  buf.size = (size_t)n_bytes;
+  pieceCache.put(key, buf);
+  return buf;
+}
+
+void send_piece(int sock, string header, const char *buf, size_t len) {
+  send_msg(sock, header);
+  size_t msg_size = htonl((uint32_t)len);
+  if (send(sock, &msg_size, sizeof(msg_size), MSG_NOSIGNAL) < 0)
+    return log_error("error sending message:", strerror(errno));
+  if (send(sock, buf, len, MSG_NOSIGNAL) < 0) return log_error("error sending message:", strerror(errno));
+}
+
+void handle_peer_command(int sock, string msg, string &remote) {
+  vector<string> cmd = split(msg, ' ');
+
+  if (cmd[0] == "bitfield") { // file-id peer-address bitfield
+    if (cmd.size() < 4) return send_msg(sock, "INVALID COMMAND");
+    string bits;
+    {
+      lock_guard<mutex> lock(files_mtx);
+      if (files.find(cmd[1]) == files.end()) return send_msg(sock, "file does not exist");
+      File &f = files[cmd[1]];
+      remote = cmd[2];
+      if (f.rem) {
+        Peer &p = f.peers[remote];
+        count_peer(f, p, false);
+        p.have = decode_bitfield(cmd[3], f.hashes.size());
+        count_peer(f, p, true);
+      }
+      bits = encode_bitfield(f.have);
+    }
+    send_msg(sock, "Success\n" + bits);
+
+  } else if (cmd[0] == "have") { // file-id piece; no reply, updates the swarm view of a downloading file
+    if (cmd.size() < 3 or remote.empty()) return;
+    size_t piece = strtoul(cmd[2].c_str(), nullptr, 10);
+    lock_guard<mutex> lock(files_mtx);
+    if (files.find(cmd[1]) == files.end()) return;
+    File &f = files[cmd[1]];
+    if (not f.rem or piece == 0 or piece > f.hashes.size()) return;
+    Peer &p = f.peers[remote];
+    p.have.resize(f.hashes.size(), false);
+    if (p.counted and not p.have[piece - 1]) set_avail(f, piece - 1, f.avail[piece - 1] + 1);
+    p.have[piece - 1] = true;
+
+  } else if (cmd[0] == "request_file_piece") {
+    if (cmd.size() < 3) return send_msg(sock, "INVALID COMMAND");
+    size_t piece = strtoul(cmd[2].c_str(), nullptr, 10);
+    if (piece == 0) return send_msg(sock, "invalid input, piece value should be positive");
+    piece = piece - 1;
+    bool compress = cmd.size() > 3 and cmd[3] == "zlib"; // the downloader accepts a compressed piece
+    string path;
+    size_t raw_size;
+    string header = "Success";
+    {
+      lock_guard<mutex> lock(files_mtx);
+      if (files.find(cmd[1]) == files.end()) return send_msg(sock, "file does not exist");
+      File &f = files[cmd[1]];
+      if (piece >= f.have.size() or not f.have[piece]) return send_msg(sock, "piece not available");
+      path = f.path;
+      raw_size = min((size_t)PIECE_SIZE, (size_t)f.size - piece * PIECE_SIZE);
+      string proof;
+      if (not f.root.empty() and not merkle_proof(f.tree, piece, proof)) return send_msg(sock, "piece not available");
+      if (not f.root.empty()) header += " proof=" + proof;
+    }
+    string key = cmd[1] + " " + to_string(piece);
+    PoolBuf raw, z;
+    if (compress and not pieceCache.get_compressed(key, z)) {
+      if (not (raw = read_piece(key, path, piece)).data) return send_msg(sock, "could not read file");
+      if (compress_piece(raw, z)) pieceCache.put_compressed(key, z);
+    }
+    if (z.data) return send_piece(sock, sprint(header, "zlib", raw_size), z.get(), z.size);
+    if (not raw.data and not (raw = read_piece(key, path, piece)).data) return send_msg(sock, "could not read file");
+    send_piece(sock, header, raw.get(), raw.size);
+
+  } else if (cmd[0] == "get_proof") { // file-id piece; for pieces copied without going through request_file_piece
+    if (cmd.size() < 3) return send_msg(sock, "INVALID COMMAND");
+    size_t piece = strtoul(cmd[2].c_str(), nullptr, 10);
+    if (piece == 0) return send_msg(sock, "invalid input, piece value should be positive");
+    string proof;
+    {
+      lock_guard<mutex> lock(files_mtx);
+      if (files.find(cmd[1]) == files.end()) return send_msg(sock, "file does not exist");
+      File &f = files[cmd[1]];
+      if (piece > f.have.size() or not f.have[piece - 1] or f.root.empty() or
+          not merkle_proof(f.tree, piece - 1, proof))
+        return send_msg(sock, "proof not available");
+    }
+    send_msg(sock, "Success proof=" + proof);
+
+  } else {
+    send_msg(sock, "INVALID COMMAND");
+  }
+}
 
 void handle_peer(int sock) {
   log_info("Peer connected:", sock);
+  string remote; // listening address of the peer, learnt from its bitfield
 
   while (true) {
     string msg = recv_msg(sock);
@@ -53,87 +461,129 @@ void handle_peer(int sock) {
       return;
     }
     log_info("Client", sock, msg);
-    vector<string> cmd = split(msg, ' ');
-    if (cmd[0] != "request_file_piece" || cmd.size() < 3) return send_msg(sock, "INVALID COMMAND");
-    size_t piece = strtoul(cmd[2].c_str(), nullptr, 10);
-    if (piece == 0) return send_msg(sock, "invalid input, piece value should be positive");
-    piece = piece - 1;
-    if (groupFiles.find(cmd[1]) == groupFiles.end()) return send_msg(sock, "file does not exist");
-    File &f = groupFiles[cmd[1]];
-    log_info("opening", f.path, "for sharing");
-    f.fd = open(f.path.c_str(), O_RDONLY);
-    if (f.fd < 0) {
-      log_error("could not open file for sharing");
-      return;
-    }
-    log_info("opened", f.path, "for sharing");
-    char buf[PIECE_SIZE];
-
-    if (lseek(f.fd, piece * PIECE_SIZE, SEEK_SET) < 0) {
-      log_error("error seeking file", strerror(errno));
-      close(f.fd);
-      return;
-    }
-    ssize_t n_bytes;
-    if ((n_bytes = read(f.fd, &buf, sizeof(buf))) < 0) {
-      log_error("error reading file", strerror(errno));
-      close(f.fd);
-      return;
-    }
-    close(f.fd);
-    send_msg(sock, "Success");
-    // size_t msg_size = htonl(sizeof(buf));
-    size_t msg_size = htonl(n_bytes);
-    if (send(sock, &msg_size, sizeof(msg_size), 0) < 0) return log_error("error sending message:", strerror(errno));
-    if (send(sock, buf, n_bytes, 0) < 0) return log_error("error sending message:", strerror(errno));
+    handle_peer_command(sock, msg, remote);
   }
   close(sock);
 }
 
 void connect_to_tracker(string tracker_info_file_path, int &tracker_sock) {
-  PortAddress tracker_info[TRACKERS];
+  vector<PortAddress> tracker_info(TRACKERS);
   vector<string> file_lines = read_n_file_lines(tracker_info_file_path, TRACKERS);
   for (size_t i = 0; i < TRACKERS; i++) tracker_info[i] = parse_port_address(file_lines[i]);
 
-  if ((tracker_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) panic("Could not create socket:", strerror(errno));
-
-  bool success = false;
-  for (int i = 0; i < TRACKERS; i++) {
+  // in order: the trackers do not share state, so every client has to end up on the same one
+  tracker_sock = -1;
+  for (size_t i = 0; i < TRACKERS and tracker_sock < 0; i++) {
     log_info("Connecting to tracker", i + 1);
-    struct sockaddr_in server_addr;
-    server_addr.sin_addr.s_addr = tracker_info[i].ip;
-    server_addr.sin_port = htons(tracker_info[i].port); // convert from host to network byte order
-    server_addr.sin_family = AF_INET;
+    tracker_sock = dial({tracker_info[i]}, TRACKER_CONNECT_TIMEOUT_MS, true)[0];
+    if (tracker_sock >= 0) log_info("Connected to tracker", i + 1);
+  }
+  if (tracker_sock < 0) panic("Could not connect to any tracker");
+}
 
-    if (connect(tracker_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-      log_error("Could not connect to server:", strerror(errno));
-    } else {
-      success = true;
-      break;
+// Multiplexes requests from the REPL and every running download over the single tracker connection. Requests are
+// tagged "#<id> " and the tracker echoes the tag back, so replies are routed to whichever caller is waiting on them.
+struct TrackerClient {
+  int sock = -1;
+  mutex mtx;
+  condition_variable cv;
+  vector<string> outbox;                             // requests waiting for the writer
+  unordered_map<uint64_t, promise<string>> pending; // request id -> caller waiting for the reply
+  uint64_t next_id = 1;
+  bool closed = false;
+  thread writer;
+
+  void start(int tracker_sock) {
+    sock = tracker_sock;
+    thread reader(&TrackerClient::read_replies, this);
+    reader.detach();
+    writer = thread(&TrackerClient::write_requests, this);
+  }
+
+  // returns the tracker's reply, or "quit" if the tracker disconnected
+  string request(string cmd) {
+    future<string> reply;
+    {
+      lock_guard<mutex> lock(mtx);
+      if (closed) return "quit";
+      uint64_t id = next_id++;
+      reply = pending[id].get_future();
+      outbox.push_back("#" + to_string(id) + " " + cmd);
     }
+    cv.notify_one();
+    return reply.get();
   }
-  if (!success) {
-    close(tracker_sock);
-    exit(EXIT_FAILURE);
+
+  // sends "quit" after everything already queued and waits for it to be written
+  void stop() {
+    {
+      lock_guard<mutex> lock(mtx);
+      if (not closed) outbox.push_back("quit");
+      closed = true;
+    }
+    cv.notify_one();
+    if (writer.joinable()) writer.join();
   }
 
-  log_info("Connected to server");
-}
+  // everything queued since the last write goes out in a single send
+  void write_requests() {
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+      cv.wait(lock, [this] { return not outbox.empty() or closed; });
+      if (outbox.empty()) return;
+      string batch;
+      for (auto &msg : outbox) batch += frame_msg(msg);
+      outbox.clear();
+      lock.unlock();
+      size_t sent = 0;
+      while (sent < batch.size()) {
+        ssize_t n_bytes = send(sock, batch.data() + sent, batch.size() - sent, MSG_NOSIGNAL);
+        if (n_bytes < 0) {
+          log_error("error sending message:", strerror(errno));
+          break;
+        }
+        sent += (size_t)n_bytes;
+      }
+      lock.lock();
+    }
+  }
 
-string hash_to_hex(unsigned char *hash, unsigned int hash_len) {
-  stringstream ss;
-  for (unsigned int i = 0; i < hash_len; i++) ss << hex << setw(2) << setfill('0') << (int)hash[i];
-  return ss.str();
-}
+  void read_replies() {
+    while (true) {
+      string msg = recv_msg(sock);
+      if (msg == "" || msg == "quit") break;
+      size_t tag_end = msg.find(' ');
+      if (msg[0] != '#' or tag_end == string::npos) {
+        log_error("unexpected message from tracker:", msg);
+        continue;
+      }
+      uint64_t id = strtoull(msg.substr(1, tag_end - 1).c_str(), nullptr, 10);
+      lock_guard<mutex> lock(mtx);
+      auto it = pending.find(id);
+      if (it == pending.end()) continue;
+      it->second.set_value(msg.substr(tag_end + 1));
+      pending.erase(it);
+    }
+    lock_guard<mutex> lock(mtx);
+    if (not closed) log_error("tracker disconnected");
+    closed = true;
+    for (auto &x : pending) x.second.set_value("quit");
+    pending.clear();
+    cv.notify_one();
+  }
+};
+
+TrackerClient tracker;
 
 bool get_file_hashes(File &f) {
-  char buffer[PIECE_SIZE];
+  PoolBuf buf = piecePool.acquire();
+  char *buffer = buf.get();
   ssize_t n_bytes;
   EVP_MD_CTX *md_chunk_ctx = EVP_MD_CTX_new();
   EVP_MD_CTX *md_total_ctx = EVP_MD_CTX_new();
   const EVP_MD *md = EVP_sha1();
   EVP_DigestInit_ex(md_total_ctx, md, nullptr);
-  while ((n_bytes = read(f.fd, buffer, sizeof(buffer))) > 0) {
+  while ((n_bytes = read(f.fd, buffer, PIECE_SIZE)) > 0) {
     unsigned char chunk_hash[EVP_MAX_MD_SIZE];
     unsigned int chunk_hash_len = 0;
     EVP_DigestInit_ex(md_chunk_ctx, md, nullptr);
@@ -153,139 +603,560 @@ bool get_file_hashes(File &f) {
   return true;
 }
 
-void download_file(string groupId, string file_name, int tracker_sock) {
-  string file_id = groupId + "::" + file_name;
-  File &f = groupFiles[file_id];
-  log_info("increasing file size to", f.size, "for writing");
-  if (lseek(f.fd, f.size - 1, SEEK_SET) == -1) {
-    log_error("Could not seek file:", strerror(errno));
-    close(f.fd);
-    groupFiles.erase(file_id);
-    return;
+bool is_blacklisted(string peer_addr) {
+  lock_guard<mutex> lock(blacklist_mtx);
+  auto it = failedPeers.find(peer_addr);
+  if (it == failedPeers.end()) return false;
+  if (chrono::steady_clock::now() < it->second) return true;
+  failedPeers.erase(it);
+  return false;
+}
+
+void blacklist_peer(string peer_addr) {
+  lock_guard<mutex> lock(blacklist_mtx);
+  failedPeers[peer_addr] = chrono::steady_clock::now() + chrono::seconds(PEER_BLACKLIST_SECS);
+}
+
+// asks the tracker for the swarm and adds peers not seen yet
+bool refresh_peers(File &f, string groupId, string file_name) {
+  string msg = tracker.request(sprint("get_peers", groupId, file_name));
+  if (msg == "" || msg == "quit") {
+    log_error("maybe tracker disconnected");
+    return false;
   }
-  if (write(f.fd, "", 1) != 1) {
-    log_error("error writing file:", strerror(errno));
-    close(f.fd);
-    groupFiles.erase(file_id);
-    return;
+  vector<string> info = split(msg, '\n');
+  if (info[0] != "Success") {
+    log_error("Server:", msg);
+    return false;
   }
-  while (f.rem) {
-    send_msg(tracker_sock, sprint("get_rarest_piece_info", groupId, file_name));
-    string msg = recv_msg(tracker_sock);
-    if (msg == "" || msg == "quit") {
-      log_error("maybe tracker disconnected");
-      close(f.fd);
-      groupFiles.erase(file_id);
-      return;
+  lock_guard<mutex> lock(files_mtx);
+  for (size_t i = 1; i < info.size(); i++) {
+    vector<string> tmp = split(info[i], ':'); // ip:port:path
+    if (tmp.size() < 3) continue;
+    string peer_addr = tmp[0] + ":" + tmp[1];
+    if (peer_addr == self_addr) continue;
+    f.peers[peer_addr].path = info[i].substr(peer_addr.size() + 1);
+  }
+  return true;
+}
+
+// exchanges bitfields with a connected peer, replacing our view of what it holds
+bool exchange_bitfield(File &f, string file_id, Peer &p) {
+  string bits;
+  {
+    lock_guard<mutex> lock(files_mtx);
+    bits = encode_bitfield(f.have);
+  }
+  send_msg(p.sock, sprint("bitfield", file_id, self_addr, bits));
+  vector<string> resp = split(recv_msg(p.sock), '\n');
+  if (resp[0] != "Success" or resp.size() < 2) return false;
+  lock_guard<mutex> lock(files_mtx);
+  count_peer(f, p, false);
+  p.have = decode_bitfield(resp[1], f.hashes.size());
+  count_peer(f, p, true);
+  return true;
+}
+
+// forgets a peer that failed us; it is not dialed again for PEER_BLACKLIST_SECS even if the tracker lists it
+void drop_peer(File &f, string peer_addr) {
+  blacklist_peer(peer_addr);
+  lock_guard<mutex> lock(files_mtx);
+  if (f.peers[peer_addr].sock >= 0) close(f.peers[peer_addr].sock);
+  count_peer(f, f.peers[peer_addr], false);
+  f.peers.erase(peer_addr);
+}
+
+// Keeps up to MAX_PEERS connections: dials a random set of the known peers we are not connected to, all at once, and
+// exchanges bitfields with the ones that answer in time. With `rotate`, a full set first lets go of its worst scoring
+// peer so that other peers of a large swarm get tried over time. With `resync` also re-reads the bitfields of the
+// peers already connected
+void connect_peers(File &f, string file_id, bool resync, bool rotate) {
+  vector<string> dial_addrs, sync_addrs;
+  {
+    lock_guard<mutex> lock(files_mtx);
+    vector<string> connected;
+    for (auto &x : f.peers) {
+      if (x.second.sock >= 0) connected.push_back(x.first);
+      else if (not is_blacklisted(x.first)) dial_addrs.push_back(x.first);
     }
-    vector<string> info = split(msg, '\n');
-    if (info[0] != "Success") {
-      log_error("Server:", msg);
-      close(f.fd);
-      groupFiles.erase(file_id);
-      return;
+    if (rotate and connected.size() >= MAX_PEERS and not dial_addrs.empty()) {
+      auto worst = connected.begin();
+      {
+        lock_guard<mutex> stats_lock(stats_mtx);
+        for (auto it = connected.begin(); it != connected.end(); it++)
+          if (peerStats[*it].score() < peerStats[*worst].score()) worst = it;
+      }
+      Peer &p = f.peers[*worst];
+      close(p.sock);
+      count_peer(f, p, false);
+      p.sock = -1;
+      p.have.clear();
+      connected.erase(worst);
     }
-    if (info.size() < 3) {
-      log_error("something unexpected happened (info)", msg);
-      close(f.fd);
-      groupFiles.erase(file_id);
-      return;
+    if (resync) sync_addrs = connected;
+    thread_local mt19937 rng(random_device{}());
+    shuffle(dial_addrs.begin(), dial_addrs.end(), rng);
+    dial_addrs.resize(min(dial_addrs.size(), MAX_PEERS - connected.size()));
+  }
+  vector<PortAddress> targets;
+  for (auto &peer_addr : dial_addrs) targets.push_back(parse_port_address(peer_addr));
+  if (not targets.empty()) log_info("connecting to", targets.size(), "peers");
+  vector<int> socks = dial(targets, PEER_CONNECT_TIMEOUT_MS, false);
+  for (size_t i = 0; i < dial_addrs.size(); i++) {
+    if (socks[i] < 0) {
+      drop_peer(f, dial_addrs[i]);
+      continue;
     }
-    size_t piece = strtoul(info[1].c_str(), nullptr, 10);
-    if (piece == 0) {
-      log_error("something unexpected happened (count)", msg);
-      close(f.fd);
-      groupFiles.erase(file_id);
-      return;
+    // a peer that accepted the connection and then hung fails its request here instead of stalling the download
+    struct timeval timeout = {PEER_IO_TIMEOUT_SECS, 0};
+    setsockopt(socks[i], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socks[i], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    lock_guard<mutex> lock(files_mtx);
+    f.peers[dial_addrs[i]].sock = socks[i];
+    sync_addrs.push_back(dial_addrs[i]);
+  }
+  for (auto &peer_addr : sync_addrs) {
+    Peer *p;
+    {
+      lock_guard<mutex> lock(files_mtx);
+      p = &f.peers[peer_addr];
     }
+    if (not exchange_bitfield(f, file_id, *p)) drop_peer(f, peer_addr);
+  }
+}
 
-    int peer = socket(AF_INET, SOCK_STREAM, 0);
-    if (peer < 0) {
-      log_error("could not create socket", strerror(errno));
-      close(f.fd);
-      groupFiles.erase(file_id);
-      return;
-    }
+double PeerStats::score() {
+  if (not sampled) return HUGE_VAL; // try every peer at least once
+  double piece_time = rtt + PIECE_SIZE / max(throughput, 1.0);
+  return 1 / (piece_time * (double)(1 + inflight));
+}
 
-    bool success = false;
-    size_t i = 2;
-    while (not success and info.size() - i >= 2) {
-      print("connecting to peer", i);
-      vector<string> tmp = split(info[info.size() - i], ':');
-      if (tmp.size() < 3) {
-        log_error("something unexpected happened", msg);
-        close(peer);
-        close(f.fd);
-        groupFiles.erase(file_id);
-        return;
-      }
-      PortAddress peer_info = parse_port_address(tmp[0] + ":" + tmp[1]);
+void begin_request(string peer_addr) {
+  lock_guard<mutex> lock(stats_mtx);
+  peerStats[peer_addr].inflight++;
+}
 
-      struct sockaddr_in peer_addr;
-      peer_addr.sin_addr.s_addr = peer_info.ip;
-      peer_addr.sin_port = htons(peer_info.port); // convert from host to network byte order
-      peer_addr.sin_family = AF_INET;
+// folds a finished piece request into the peer's averages; a failed request halves its throughput estimate
+void end_request(string peer_addr, bool ok, double rtt, double secs, size_t bytes) {
+  lock_guard<mutex> lock(stats_mtx);
+  PeerStats &p = peerStats[peer_addr];
+  p.inflight--;
+  if (not ok) {
+    p.throughput /= 2;
+    return;
+  }
+  double throughput = (double)bytes / max(secs, 1e-6);
+  p.rtt = p.sampled ? (1 - EWMA_WEIGHT) * p.rtt + EWMA_WEIGHT * rtt : rtt;
+  p.throughput = p.sampled ? (1 - EWMA_WEIGHT) * p.throughput + EWMA_WEIGHT * throughput : throughput;
+  p.sampled = true;
+}
 
-      if (connect(peer, (struct sockaddr *)&peer_addr, sizeof(peer_addr)) < 0) {
-        log_error("Could not connect to peer:", strerror(errno));
-        i++;
-      } else {
-        success = true;
+// the connected peers, best scoring first
+vector<string> ranked_peers(File &f) {
+  vector<pair<double, string>> scored;
+  {
+    lock_guard<mutex> stats_lock(stats_mtx);
+    for (auto &x : f.peers)
+      if (x.second.sock >= 0) scored.push_back({peerStats[x.first].score(), x.first});
+  }
+  sort(scored.rbegin(), scored.rend());
+  vector<string> res;
+  for (auto &x : scored) res.push_back(x.second);
+  return res;
+}
+
+// the ranked peers holding a piece
+vector<string> piece_holders(File &f, size_t piece, const vector<string> &ranked) {
+  vector<string> res;
+  for (auto &x : ranked)
+    if (piece < f.peers[x].have.size() and f.peers[x].have[piece]) res.push_back(x);
+  return res;
+}
+
+// rarest-first over the local swarm view, preferring among the first RAREST_TIES equally rare pieces the one held by
+// the best scoring peer. A streaming download first takes the earliest missing piece within STREAM_WINDOW pieces of
+// what it has emitted, and only falls back to rarest-first when none of those is available. The piece is asked from
+// its best scoring holder, except for EXPLORE_PERCENT of the requests which go to a random holder so that the
+// estimates of the other peers stay fresh. Returns false if no connected peer has a missing piece
+bool pick_piece(File &f, size_t &piece, string &peer_addr) {
+  lock_guard<mutex> lock(files_mtx);
+  if (f.rarest.empty()) return false;
+  vector<string> ranked = ranked_peers(f);
+  bool found = false;
+  for (size_t i = f.next_emit; f.stream and i < min(f.next_emit + STREAM_WINDOW, f.hashes.size()) and not found; i++)
+    if (not f.have[i] and f.avail[i]) {
+      piece = i;
+      found = true;
+    }
+  if (not found) {
+    size_t best_rank = SIZE_MAX, ties = 0;
+    for (auto it = f.rarest.begin(); it != f.rarest.end() and it->first == f.rarest.begin()->first; it++) {
+      size_t rank = 0;
+      while (rank < ranked.size() and piece_holders(f, it->second, {ranked[rank]}).empty()) rank++;
+      if (rank < best_rank) {
+        best_rank = rank;
+        piece = it->second;
       }
+      if (++ties == RAREST_TIES) break;
     }
-    if (not success) {
-      log_error("could not connect to any peer");
-      close(peer);
-      close(f.fd);
-      groupFiles.erase(file_id);
-      return;
+  }
+  vector<string> holders = piece_holders(f, piece, ranked);
+  if (holders.empty()) return false;
+  peer_addr = holders[0];
+  thread_local mt19937 rng(random_device{}());
+  if (holders.size() > 1 and rng() % 100 < EXPLORE_PERCENT) peer_addr = holders[rng() % holders.size()];
+  return true;
+}
+
+bool recv_piece(int peer, char *buf, size_t cap, size_t &msg_size) {
+  size_t size = 0;
+  ssize_t n_bytes = 0;
+  if ((n_bytes = read(peer, &size, sizeof(size))) < 0) {
+    log_error("Could not read from socket:", strerror(errno));
+    return false;
+  }
+  if (n_bytes == 0) {
+    log_error(peer, "disconnected");
+    return false;
+  }
+  msg_size = ntohl((uint32_t)size);
+  if (msg_size > cap) {
+    log_error("piece too large:", msg_size);
+    return false;
+  }
+  size_t recieved = 0;
+  while (recieved < msg_size) {
+    if ((n_bytes = read(peer, buf + recieved, msg_size - recieved)) < 0) {
+      log_error("Could not read from socket:", strerror(errno));
+      return false;
     }
-    log_info("Connected to peer");
-    send_msg(peer, sprint("request_file_piece", file_id, piece));
-    msg = recv_msg(peer);
-    if (msg != "Success") {
-      log_error("something unexpected happened", msg);
-      return;
+    if (n_bytes == 0) return false;
+    recieved += (size_t)n_bytes;
+  }
+  return true;
+}
+
+// peers on this machine (e.g. several clients sharing a disk) let us copy pieces without going through TCP
+bool is_same_host(string peer_addr) {
+  uint32_t ip = parse_port_address(peer_addr).ip;
+  return (ntohl(ip) >> 24) == 127 or local_ips.find(ip) != local_ips.end();
+}
+
+void load_local_ips() {
+  struct ifaddrs *addrs;
+  if (getifaddrs(&addrs) < 0) return log_error("could not list network interfaces:", strerror(errno));
+  for (struct ifaddrs *a = addrs; a != nullptr; a = a->ifa_next)
+    if (a->ifa_addr != nullptr and a->ifa_addr->sa_family == AF_INET)
+      local_ips.insert(((struct sockaddr_in *)(void *)a->ifa_addr)->sin_addr.s_addr);
+  freeifaddrs(addrs);
+}
+
+// the path handed to the tracker; same-host peers open it directly, whatever their own working directory is
+string absolute_path(string path) {
+  string dir = path, name = path;
+  char *real = realpath(dirname(dir.data()), nullptr);
+  if (real == nullptr) return path;
+  string res = string(real) == "/" ? "" : string(real);
+  free(real);
+  return res + "/" + basename(name.data());
+}
+
+// copies a piece straight out of a same-host peer's file, as a reflink where the filesystem supports it and with
+// copy_file_range otherwise; the piece is read back into buf so that it is verified like one received over TCP
+bool copy_local_piece(File &f, string src_path, size_t piece, char *buf, size_t len) {
+  int src = open(src_path.c_str(), O_RDONLY);
+  if (src < 0) return false;
+  __off_t offset = (__off_t)(piece * PIECE_SIZE);
+  struct file_clone_range range = {src, (uint64_t)offset, len, (uint64_t)offset};
+  bool copied = ioctl(f.fd, FICLONERANGE, &range) == 0;
+  size_t done = 0;
+  while (not copied and done < len) {
+    loff_t in = offset + (loff_t)done, out = in;
+    ssize_t n_bytes = copy_file_range(src, &in, f.fd, &out, len - done, 0);
+    if (n_bytes <= 0) break;
+    done += (size_t)n_bytes;
+  }
+  close(src);
+  if (not copied and done < len) {
+    log_info("could not copy piece", piece + 1, "from", src_path, strerror(errno));
+    return false;
+  }
+  return pread(f.fd, buf, len, offset) == (ssize_t)len;
+}
+
+// a download of content this client already holds is copied out of its own store, checked piece by piece
+bool copy_local_file(const File &held, string dest_path) {
+  File dest;
+  dest.fd = open(dest_path.c_str(), O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (dest.fd < 0) {
+    log_error("could not open file:", strerror(errno));
+    return false;
+  }
+  PoolBuf buf = piecePool.acquire();
+  bool ok = true;
+  for (size_t piece = 0; ok and piece < held.hashes.size(); piece++) {
+    size_t len = min((size_t)PIECE_SIZE, (size_t)held.size - piece * PIECE_SIZE);
+    ok = copy_local_piece(dest, held.path, piece, buf.get(), len) and sha1_hex(buf.get(), len) == held.hashes[piece];
+  }
+  close(dest.fd);
+  return ok;
+}
+
+// requests a piece over TCP, asking for it compressed if the download was started with --compress
+bool fetch_piece(int peer, string file_id, size_t piece, bool compress, char *buf, char *z_buf, size_t &msg_size,
+                 string &proof, double &rtt) {
+  string request = sprint("request_file_piece", file_id, piece + 1);
+  auto start = chrono::steady_clock::now();
+  send_msg(peer, compress ? request + " zlib" : request);
+  string header = recv_msg(peer);
+  rtt = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  vector<string> reply = split(header, ' ');
+  if (reply[0] != "Success") {
+    log_error("peer:", header);
+    return false;
+  }
+  size_t expected = 0; // size of the piece before compression; 0 if sent raw
+  for (size_t i = 1; i < reply.size(); i++) {
+    if (reply[i] == "zlib" and i + 1 < reply.size()) expected = strtoul(reply[++i].c_str(), nullptr, 10);
+    if (reply[i].rfind("proof=", 0) == 0) proof = reply[i].substr(6);
+  }
+  if (not expected) return recv_piece(peer, buf, PIECE_SIZE, msg_size);
+
+  size_t z_size = 0;
+  if (not recv_piece(peer, z_buf, POOL_BUFFER_SIZE, z_size)) return false;
+  uLongf raw_size = PIECE_SIZE;
+  if (uncompress((Bytef *)buf, &raw_size, (const Bytef *)z_buf, z_size) != Z_OK) {
+    log_error("could not decompress piece", piece + 1);
+    return false;
+  }
+  msg_size = raw_size;
+  log_info("Piece", piece + 1, "received compressed:", z_size, "->", msg_size);
+  return msg_size == expected;
+}
+
+bool request_proof(int peer, string file_id, size_t piece, string &proof) {
+  send_msg(peer, sprint("get_proof", file_id, piece + 1));
+  string reply = recv_msg(peer);
+  if (reply.rfind("Success proof=", 0) != 0) return false;
+  proof = reply.substr(14);
+  return true;
+}
+
+// checks a received piece against its hash, or in merkle mode against the root through the proof sent with it
+bool verify_piece(File &f, size_t piece, const char *buf, size_t len, string proof) {
+  string leaf = sha1_hex(buf, len);
+  lock_guard<mutex> lock(files_mtx);
+  if (f.root.empty()) return leaf == f.hashes[piece];
+  if (not merkle_verify(f.tree, f.root, piece, leaf, proof)) return false;
+  f.hashes[piece] = leaf;
+  return true;
+}
+
+// writes to the non-blocking stream output, checking every second whether streaming was stopped meanwhile
+bool write_stream(File &f, const char *buf, size_t len) {
+  size_t written = 0;
+  while (written < len) {
+    ssize_t n = write(f.stream_fd, buf + written, len - written);
+    if (n >= 0) {
+      written += (size_t)n;
+      continue;
     }
-    size_t msg_size = 0;
-    ssize_t n_bytes = 0;
-    if ((n_bytes = read(peer, &msg_size, sizeof(msg_size))) < 0) {
-      log_error("Could not read from socket:", strerror(errno));
-      return;
+    if (errno != EAGAIN and errno != EWOULDBLOCK) return false;
+    struct pollfd pfd = {f.stream_fd, POLLOUT, 0};
+    poll(&pfd, 1, 1000);
+    lock_guard<mutex> lock(files_mtx);
+    if (not f.stream) return false;
+  }
+  return true;
+}
+
+// emits the verified pieces to the stream output in order as they arrive. Runs on its own thread, so a slow reader
+// holds back the stream but not the download
+void stream_pieces(File &f) {
+  while (true) {
+    size_t piece;
+    {
+      unique_lock<mutex> lock(files_mtx);
+      emit_cv.wait(lock, [&] { return not f.stream or f.next_emit == f.hashes.size() or f.have[f.next_emit]; });
+      if (not f.stream or f.next_emit == f.hashes.size()) break;
+      piece = f.next_emit;
     }
-    if (n_bytes == 0) {
-      log_error(peer, "disconnected");
-      return;
+    PoolBuf buf = piecePool.acquire();
+    size_t len = min((size_t)PIECE_SIZE, (size_t)f.size - piece * PIECE_SIZE);
+    bool ok = pread(f.fd, buf.get(), len, (__off_t)(piece * PIECE_SIZE)) == (ssize_t)len and
+              write_stream(f, buf.get(), len);
+    lock_guard<mutex> lock(files_mtx);
+    if (not f.stream) break;
+    if (not ok) {
+      log_error("could not stream piece", piece + 1, strerror(errno), "; no longer streaming");
+      f.stream = false;
+      break;
+    }
+    f.next_emit++;
+  }
+  close(f.stream_fd);
+}
+
+// waits for the emitter of a download to drain, or with stop makes it give up first
+void join_streamer(string file_id, bool stop) {
+  thread t;
+  {
+    lock_guard<mutex> lock(files_mtx);
+    auto it = streamers.find(file_id);
+    if (it == streamers.end()) return;
+    if (stop) files[file_id].stream = false;
+    t = move(it->second);
+    streamers.erase(it);
+  }
+  emit_cv.notify_all();
+  t.join();
+}
+
+// gives up on a download: the tracker stops handing this client out for the file, and the partial file is removed
+void abort_download(string groupId, string file_name, string file_id) {
+  string msg = tracker.request(sprint("stop_share", groupId, file_name));
+  if (msg != "stopped sharing") log_error("could not leave the swarm:", msg);
+  join_streamer(file_id, true);
+  lock_guard<mutex> lock(files_mtx);
+  File &f = files[file_id];
+  for (auto &x : f.peers)
+    if (x.second.sock >= 0) close(x.second.sock);
+  close(f.fd);
+  if (unlink(f.path.c_str()) == 0) log_error("removed partial file", f.path);
+  files.erase(file_id);
+  for (auto it = groupFiles.begin(); it != groupFiles.end();)
+    it = it->second == file_id ? groupFiles.erase(it) : next(it);
+}
+
+// the download is a swarm over the file's content: peers are asked for pieces by file hash, the group is only used for
+// the tracker's permission checks
+void download_file(string groupId, string file_name, string file_id) {
+  File *fp;
+  {
+    lock_guard<mutex> lock(files_mtx);
+    fp = &files[file_id];
+  }
+  File &f = *fp;
+  log_info("increasing file size to", f.size, "for writing");
+  if (lseek(f.fd, f.size - 1, SEEK_SET) == -1) {
+    log_error("Could not seek file:", strerror(errno));
+    return abort_download(groupId, file_name, file_id);
+  }
+  if (write(f.fd, "", 1) != 1) {
+    log_error("error writing file:", strerror(errno));
+    return abort_download(groupId, file_name, file_id);
+  }
+
+  // the tracker is only used to join the swarm and to occasionally refresh the peer list; piece availability is
+  // exchanged directly with the peers as bitfields and have-updates
+  string msg = tracker.request(sprint("add_peer", groupId, file_name, f.path));
+  if (msg != "added") {
+    log_error("could not join the swarm:", msg);
+    return abort_download(groupId, file_name, file_id);
+  }
+  if (f.stream) {
+    // opened here rather than in the REPL as opening a fifo blocks until its reader shows up
+    f.stream_fd = open(f.stream_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (f.stream_fd < 0) {
+      log_error("could not open", f.stream_path, "for streaming:", strerror(errno));
+      return abort_download(groupId, file_name, file_id);
     }
-    msg_size = ntohl(msg_size);
-    log_info("Piece", piece, "size:", msg_size);
-    // vector<char> msg_buf(msg_size);
-    char msg_buf[PIECE_SIZE];
-    ssize_t recieved = 0;
-    while (recieved < msg_size) {
-      if ((n_bytes = read(peer, msg_buf + recieved, msg_size - recieved)) < 0) {
-        log_error("Could not read from socket (here):", strerror(errno));
-        return;
-      }
-      if (n_bytes == 0) return;
-      recieved += n_bytes;
+    fcntl(f.stream_fd, F_SETFL, fcntl(f.stream_fd, F_GETFL) | O_NONBLOCK);
+    lock_guard<mutex> lock(files_mtx);
+    streamers[file_id] = thread(stream_pieces, ref(f));
+  }
+
+  size_t since_refresh = REFRESH_INTERVAL;
+  size_t idle = 0;
+  while (f.rem) {
+    if (since_refresh >= REFRESH_INTERVAL) {
+      if (not refresh_peers(f, groupId, file_name)) return abort_download(groupId, file_name, file_id);
+      since_refresh = 0;
     }
-    piece--;
-    if (lseek(f.fd, piece * PIECE_SIZE, SEEK_SET) < 0) {
-      log_error("could not seek file", strerror(errno));
-      return;
+    connect_peers(f, file_id, idle > 0, since_refresh == 0);
+
+    size_t piece;
+    string peer_addr;
+    if (not pick_piece(f, piece, peer_addr)) {
+      if (++idle > MAX_IDLE_ROUNDS) {
+        log_error("no peer has the remaining pieces of", file_id);
+        return abort_download(groupId, file_name, file_id);
+      }
+      since_refresh = REFRESH_INTERVAL;
+      sleep(1);
+      continue;
     }
-    if (write(f.fd, &msg_buf, msg_size) < 0) {
-      log_error("error writing file", strerror(errno));
-      return;
+    // released at the end of the iteration; waits here while the pool is exhausted
+    vector<PoolBuf> bufs = piecePool.acquire(f.compress ? 2 : 1);
+    char *buf = bufs[0].get();
+
+    int peer;
+    string peer_path;
+    {
+      lock_guard<mutex> lock(files_mtx);
+      peer = f.peers[peer_addr].sock;
+      peer_path = f.peers[peer_addr].path;
+    }
+    size_t expected = min((size_t)PIECE_SIZE, (size_t)f.size - piece * PIECE_SIZE);
+    string proof;
+    bool copied =
+        not peer_path.empty() and is_same_host(peer_addr) and copy_local_piece(f, peer_path, piece, buf, expected);
+    if (copied and not f.root.empty()) copied = request_proof(peer, file_id, piece, proof);
+    if (copied and verify_piece(f, piece, buf, expected, proof)) {
+      log_info("Piece", piece + 1, "copied from", peer_path);
+    } else {
+      size_t msg_size = 0;
+      double rtt = 0;
+      auto start = chrono::steady_clock::now();
+      begin_request(peer_addr);
+      char *z_buf = f.compress ? bufs[1].get() : nullptr;
+      bool ok = fetch_piece(peer, file_id, piece, f.compress, buf, z_buf, msg_size, proof, rtt);
+      end_request(peer_addr, ok, rtt, chrono::duration<double>(chrono::steady_clock::now() - start).count(), msg_size);
+      if (not ok) {
+        log_error("could not get piece", piece + 1, "from", peer_addr);
+        drop_peer(f, peer_addr);
+        continue;
+      }
+      log_info("Piece", piece + 1, "size:", msg_size);
+      if (msg_size != expected or not verify_piece(f, piece, buf, msg_size, proof)) {
+        log_error("piece", piece + 1, "from", peer_addr, "failed verification");
+        drop_peer(f, peer_addr);
+        continue;
+      }
+      if (pwrite(f.fd, buf, msg_size, (__off_t)(piece * PIECE_SIZE)) < 0) {
+        log_error("error writing file", strerror(errno));
+        return abort_download(groupId, file_name, file_id);
+      }
     }
-    f.rem--;
+
+    vector<int> socks;
+    {
+      lock_guard<mutex> lock(files_mtx);
+      mark_have(f, piece);
+      f.rem--;
+      for (auto &x : f.peers)
+        if (x.second.sock >= 0) socks.push_back(x.second.sock);
+    }
+    emit_cv.notify_all();
+    idle = 0; // only a piece gained counts as progress, a holder that keeps failing does not
+    for (int sock : socks) send_msg(sock, sprint("have", file_id, piece + 1));
+    since_refresh++;
   }
   log_info("file downloaded");
+  join_streamer(file_id, false);
   log_info("closing", f.path);
+  lock_guard<mutex> lock(files_mtx);
+  for (auto &x : f.peers)
+    if (x.second.sock >= 0) close(x.second.sock);
+  f.peers.clear();
   close(f.fd);
 }
 
+// keeps this client's lease on the tracker alive, so it stays a holder of its files while idle
+void send_heartbeats() {
+  while (tracker.request("heartbeat") != "quit") sleep(HEARTBEAT_SECS);
+}
+
 int main(int argc, char *argv[]) {
   if (argc < 3) panic("Invalid usage, 2 arguments are required");
 
@@ -294,14 +1165,19 @@ int main(int argc, char *argv[]) {
     cout << endl;
     panic("Caught interrupt signal!! Exiting...");
   });
+  signal(SIGPIPE, SIG_IGN); // a peer or stream reader going away is handled where the write fails
 
   PortAddress self_info = parse_port_address(string(argv[1]));
+  self_addr = self_info.sprint();
+  load_local_ips();
   // int listen_sock;
   thread tl(listen_for_peers, self_info, handle_peer);
   tl.detach();
 
   int tracker_sock;
   connect_to_tracker(string(argv[2]), tracker_sock);
+  tracker.start(tracker_sock);
+  thread(send_heartbeats).detach();
 
   string input;
   while (true) {
@@ -310,69 +1186,105 @@ int main(int argc, char *argv[]) {
     if (input == "") continue;
 
     vector<string> tokens = split(input, ' ');
+    string msg;
 
     if (tokens[0] == "quit") {
-      send_msg(tracker_sock, "quit");
       break;
 
+    } else if (tokens[0] == "cache_stats") {
+      print("Piece cache:", pieceCache.stats());
+      continue;
+
     } else if (tokens[0] == "login") {
       if (tokens.size() != 3) {
         log_error("Invalid command, login needs 2 arguments");
         continue;
       }
-      send_msg(tracker_sock, sprint(input, self_info.sprint()));
+      msg = tracker.request(sprint(input, self_info.sprint()));
 
     } else if (tokens[0] == "upload_file") {
-      if (tokens.size() != 3) {
+      if (tokens.size() < 3 or (tokens.size() > 3 and tokens[3] != "--merkle")) {
         log_error("Invalid command, upload_file requires 2 arguments");
         continue;
       }
-      File f;
-      f.fd = open(tokens[1].c_str(), O_RDONLY);
-      if (f.fd < 0) {
-        log_error("Could not open file:", strerror(errno));
-        continue;
-      }
-      f.path = tokens[1];
-      if (!get_file_hashes(f)) {
-        close(f.fd);
-        continue;
-      }
-      f.rem = 0;
+      bool merkle = tokens.size() > 3;
+      string path = absolute_path(tokens[1]);
       struct stat file_stat;
-      if (fstat(f.fd, &file_stat) < 0) {
+      if (stat(tokens[1].c_str(), &file_stat) < 0) {
         log_error("could not stat file", strerror(errno));
-        close(f.fd);
         continue;
       }
-      f.size = file_stat.st_size;
-      close(f.fd);
-      if (f.size == 0) {
+      if (file_stat.st_size == 0) {
         log_error("empty file; not uploading");
         continue;
       }
-      send_msg(tracker_sock, sprint(input, f.hash, f.size, f.hashes.size()));
-      string msg = recv_msg(tracker_sock);
-      if (msg == "" || msg == "quit") {
-        log_error("may be server disconnected");
-        continue;
+      File f;
+      {
+        // a file already shared in another group is not hashed again
+        lock_guard<mutex> lock(files_mtx);
+        for (auto &x : files)
+          if (x.second.path == path and not x.second.rem and x.second.size == file_stat.st_size and
+              x.second.mtime == file_stat.st_mtime)
+            f = x.second;
       }
-      if (msg != "Success") {
-        log_error("Server:", msg);
-        continue;
+      if (f.hash.empty()) {
+        f.fd = open(tokens[1].c_str(), O_RDONLY);
+        if (f.fd < 0) {
+          log_error("Could not open file:", strerror(errno));
+          continue;
+        }
+        f.path = path;
+        if (!get_file_hashes(f)) {
+          close(f.fd);
+          continue;
+        }
+        close(f.fd);
+        f.rem = 0;
+        f.compress = false;
+        f.size = file_stat.st_size;
+        f.mtime = file_stat.st_mtime;
+        f.have.assign(f.hashes.size(), true);
+      }
+      if (merkle and f.tree.empty()) {
+        f.tree = merkle_tree(f.hashes);
+        f.root = f.tree.back()[0];
+      }
+      string request = sprint("upload_file", path, tokens[2], f.hash, f.size, f.hashes.size());
+      if (merkle) request += " " + f.root; // the tracker keeps only the root, peers send proofs with the pieces
+      msg = tracker.request(request);
+      if (msg == "send hashes") { // the tracker does not know this content yet
+        for (const auto &hash : f.hashes) request += "\n" + hash;
+        msg = tracker.request(request);
       }
-      for (const auto &hash : f.hashes) send_msg(tracker_sock, hash);
-      msg = recv_msg(tracker_sock);
       if (msg == "" || msg == "quit") {
         log_error("may be server disconnected");
         continue;
       }
-      if (msg != "file uploaded") {
+      if (msg.rfind("file uploaded", 0) != 0) {
         log_error("something unexpected happened:", msg);
         continue;
       }
+      string root = msg.size() > 14 ? msg.substr(14) : ""; // merkle root if the tracker has the content in that mode
+      if (root != f.root) { // the content keeps the mode it was first shared in
+        log_info("content already shared", root.empty() ? "without" : "with", "--merkle; sharing it the same way");
+        f.tree = root.empty() ? vector<vector<string>>() : merkle_tree(f.hashes);
+        f.root = root.empty() ? "" : f.tree.back()[0];
+      }
+      if (root != f.root) {
+        log_error("piece hashes do not match the merkle root the tracker has:", root);
+        continue;
+      }
+      msg = "file uploaded";
       string file_name = basename(tokens[1].data());
-      groupFiles[tokens[2] + "::" + file_name] = f;
+      {
+        lock_guard<mutex> lock(files_mtx);
+        if (files.find(f.hash) == files.end()) files[f.hash] = f;
+        if (not files[f.hash].rem) { // a download still in progress already has the tracker's mode
+          files[f.hash].root = f.root;
+          files[f.hash].tree = f.tree;
+        }
+        groupFiles[tokens[2] + "::" + file_name] = f.hash;
+      }
       print("Server:", msg);
       continue;
 
@@ -381,8 +1293,19 @@ int main(int argc, char *argv[]) {
         log_error("Invalid command, download_file requires 3 arguments");
         continue;
       }
-      send_msg(tracker_sock, input);
-      string msg = recv_msg(tracker_sock);
+      bool compress = false, bad_option = false;
+      string stream_path; // not streaming if empty
+      for (size_t i = 4; i < tokens.size(); i++) {
+        if (tokens[i].empty()) continue; // doubled or trailing spaces
+        if (tokens[i] == "--compress") compress = true;
+        else if (tokens[i].rfind("--stream=", 0) == 0 and tokens[i].size() > 9) stream_path = tokens[i].substr(9);
+        else bad_option = true;
+      }
+      if (bad_option) {
+        log_error("Invalid option, download_file takes --compress and --stream=<path>");
+        continue;
+      }
+      msg = tracker.request(input);
       if (msg.size() == 0 || msg == "quit") {
         log_error("some error occured, may be tracker disconnected");
         break;
@@ -404,34 +1327,62 @@ int main(int argc, char *argv[]) {
         continue;
       }
       f.hash = file_info[3];
+      File held;
+      {
+        lock_guard<mutex> lock(files_mtx);
+        if (files.find(f.hash) != files.end()) { // same content shared in another group; reuse its piece store
+          groupFiles[file_info[0] + "::" + file_info[1]] = f.hash;
+          held = files[f.hash];
+        }
+      }
+      if (not held.hash.empty()) {
+        if (held.rem) log_error("already downloading to", held.path + "; download it again once that completes");
+        else if (held.path == absolute_path(tokens[3])) print("already downloaded to", held.path);
+        else if (copy_local_file(held, tokens[3])) print("copied to", tokens[3], "from", held.path);
+        else log_error("could not copy", held.path, "to", tokens[3]);
+        continue;
+      }
       size_t count = strtoul(file_info[4].c_str(), nullptr, 10);
-      if (count == 0 || count != info.size() - 3) {
+      if (file_info.size() > 5) { // merkle mode: only the root is sent, piece hashes come with the pieces
+        f.root = file_info[5];
+        f.tree = merkle_shape(count);
+      }
+      if (count == 0 || (f.root.empty() and count != info.size() - 3)) {
         print("Count:", count);
         print("info.size() - 2:", info.size() - 2);
         log_error("something unexpected happened (count):", msg);
         continue;
       }
       log_info("opening file:", tokens[3], "for writing");
-      f.fd = open(tokens[3].c_str(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+      f.fd = open(tokens[3].c_str(), O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
       if (f.fd < 0) {
         log_error("could not open file:", strerror(errno));
         continue;
       }
-      f.path = tokens[3];
+      f.path = absolute_path(tokens[3]);
+      f.mtime = 0;
       log_info("opened", f.path, "for writing");
       f.hashes.resize(count);
-      for (size_t i = 0; i < count; i++) f.hashes[i] = info[i + 2];
+      for (size_t i = 0; i < count and f.root.empty(); i++) f.hashes[i] = info[i + 2];
       f.rem = count;
-      string file_id = file_info[0] + "::" + file_info[1];
-      groupFiles[file_id] = f;
-      thread t(download_file, file_info[0], file_info[1], tracker_sock);
+      f.have.assign(count, false);
+      f.avail.assign(count, 0);
+      f.compress = compress;
+      f.stream = not stream_path.empty();
+      f.stream_path = stream_path;
+      f.next_emit = 0;
+      {
+        lock_guard<mutex> lock(files_mtx);
+        files[f.hash] = f;
+        groupFiles[file_info[0] + "::" + file_info[1]] = f.hash;
+      }
+      thread t(download_file, file_info[0], file_info[1], f.hash);
       t.detach();
       continue;
 
     } else {
-      send_msg(tracker_sock, input);
+      msg = tracker.request(input);
     }
-    string msg = recv_msg(tracker_sock);
     if (msg == "quit") {
       log_error("Server disconnected");
       break;
@@ -439,6 +1390,7 @@ int main(int argc, char *argv[]) {
     print("Server:", msg);
   }
 
+  tracker.stop();
   close(tracker_sock);
   return 0;
 }
@@ -1,7 +1,10 @@
 #include "utils.hpp"
 #include <arpa/inet.h>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <thread>
 #include <unistd.h>
@@ -17,6 +20,51 @@ string PortAddress::sprint() {
   return string(str) + ":" + to_string(this->port);
 }
 
+#define BUFFER_ALIGN 4096
+
+BufferPool::BufferPool(size_t size, size_t count)
+    : buf_size((size + BUFFER_ALIGN - 1) / BUFFER_ALIGN * BUFFER_ALIGN), capacity(count) {}
+
+vector<PoolBuf> BufferPool::acquire(size_t n) {
+  unique_lock<mutex> lock(mtx);
+  if (n > capacity) panic("buffer pool too small:", n, "buffers requested at once, capacity", capacity);
+  cv.wait(lock, [&] { return free_bufs.size() + (capacity - created) >= n; });
+  vector<PoolBuf> res(n);
+  for (auto &buf : res) buf = take();
+  return res;
+}
+
+PoolBuf BufferPool::acquire() { return acquire(1)[0]; }
+
+PoolBuf BufferPool::try_acquire() {
+  lock_guard<mutex> lock(mtx);
+  if (free_bufs.empty() and created == capacity) return PoolBuf();
+  return take();
+}
+
+PoolBuf BufferPool::take() {
+  char *data;
+  if (not free_bufs.empty()) {
+    data = free_bufs.back();
+    free_bufs.pop_back();
+  } else {
+    data = (char *)aligned_alloc(BUFFER_ALIGN, buf_size);
+    if (data == nullptr) panic("could not allocate buffer");
+    created++;
+  }
+  PoolBuf buf;
+  buf.data = shared_ptr<char>(data, [this](char *b) { release(b); });
+  return buf;
+}
+
+void BufferPool::release(char *buf) {
+  {
+    lock_guard<mutex> lock(mtx);
+    free_bufs.push_back(buf);
+  }
+  cv.notify_all();
+}
+
 vector<string> split(const string &str, char delimiter) {
   vector<string> result;
   size_t start = 0;
@@ -103,11 +151,76 @@ void listen_for_peers(PortAddress self_info, void (*handle_peer)(int sock)) {
   close(listen_sock);
 }
 
-void send_msg(int sock, string msg) {
+vector<int> dial(vector<PortAddress> addrs, int timeout_ms, bool first_only) {
+  vector<int> socks(addrs.size(), -1);
+  vector<struct pollfd> pending;
+  vector<size_t> pending_idx;
+  for (size_t i = 0; i < addrs.size(); i++) {
+    struct sockaddr_in addr;
+    addr.sin_addr.s_addr = addrs[i].ip;
+    addr.sin_port = htons(addrs[i].port); // convert from host to network byte order
+    addr.sin_family = AF_INET;
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+      log_error("Could not create socket:", strerror(errno));
+      continue;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 and errno != EINPROGRESS) {
+      log_error("Could not connect to", addrs[i].sprint(), strerror(errno));
+      close(sock);
+      continue;
+    }
+    pending.push_back({sock, POLLOUT, 0});
+    pending_idx.push_back(i);
+  }
+
+  auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+  bool done = false;
+  while (not done and not pending.empty()) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+    if (left <= 0 or poll(pending.data(), pending.size(), (int)left) <= 0) break;
+    for (size_t i = 0; i < pending.size();) {
+      if (pending[i].revents == 0) {
+        i++;
+        continue;
+      }
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err == 0 and not done) { // connected; the rest of the code expects blocking sockets
+        fcntl(pending[i].fd, F_SETFL, fcntl(pending[i].fd, F_GETFL) & ~O_NONBLOCK);
+        socks[pending_idx[i]] = pending[i].fd;
+        done = first_only;
+      } else { // failed, or connected in the same round as the one already taken
+        if (err != 0) log_error("Could not connect to", addrs[pending_idx[i]].sprint(), strerror(err));
+        close(pending[i].fd);
+      }
+      pending.erase(pending.begin() + (long)i);
+      pending_idx.erase(pending_idx.begin() + (long)i);
+    }
+  }
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (not done) log_error("Timed out connecting to", addrs[pending_idx[i]].sprint());
+    close(pending[i].fd);
+  }
+  return socks;
+}
+
+string frame_msg(string msg) {
   if (msg.size() == 0) msg += " ";
-  size_t msg_size = htonl(msg.size());
-  if (send(sock, &msg_size, sizeof(msg_size), 0) < 0) return log_error("error sending message:", strerror(errno));
-  if (send(sock, msg.c_str(), msg.size(), 0) < 0) return log_error("error sending message:", strerror(errno));
+  size_t msg_size = htonl((uint32_t)msg.size());
+  return string((char *)&msg_size, sizeof(msg_size)) + msg;
+}
+
+void send_msg(int sock, string msg) {
+  string frame = frame_msg(msg);
+  size_t sent = 0;
+  while (sent < frame.size()) {
+    ssize_t n_bytes = send(sock, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+    if (n_bytes < 0) return log_error("error sending message:", strerror(errno));
+    sent += (size_t)n_bytes;
+  }
 }
 
 string recv_msg(int sock) {
@@ -121,17 +234,16 @@ string recv_msg(int sock) {
     log_error(sock, "disconnected");
     return "quit";
   }
-  msg_size = ntohl(msg_size);
-  vector<char> msg_buf(msg_size);
-  ssize_t recieved = 0;
+  msg_size = ntohl((uint32_t)msg_size);
+  string res(msg_size, '\0'); // read straight into the result rather than through a temporary buffer
+  size_t recieved = 0;
   while (recieved < msg_size) {
-    if ((n_bytes = read(sock, msg_buf.data() + recieved, msg_size - recieved)) < 0) {
+    if ((n_bytes = read(sock, &res[recieved], msg_size - recieved)) < 0) {
       log_error("Could not read from socket:", strerror(errno));
       return "";
     }
     if (n_bytes == 0) { return "quit"; }
-    recieved += n_bytes;
+    recieved += (size_t)n_bytes;
   }
-  string res = string(msg_buf.begin(), msg_buf.end());
   return res;
 }
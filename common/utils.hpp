@@ -1,7 +1,10 @@
 #include <arpa/inet.h>
+#include <condition_variable>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <vector>
@@ -53,9 +56,40 @@ struct PortAddress {
   string sprint();
 };
 
+// A buffer handed out by a BufferPool; it goes back to the pool once the last copy is dropped
+struct PoolBuf {
+  shared_ptr<char> data;
+  size_t size = 0; // bytes in use
+  char *get() const { return data.get(); }
+};
+
+// Page-aligned buffers of a fixed size shared by all threads. At most `capacity` buffers ever exist: once they are all
+// in use acquire() waits for one to be released, throttling callers instead of letting memory grow.
+struct BufferPool {
+  size_t buf_size;
+  size_t capacity;
+  size_t created = 0;
+  vector<char *> free_bufs;
+  mutex mtx;
+  condition_variable cv;
+
+  BufferPool(size_t size, size_t count);
+  // n buffers at once, so that a caller needing several cannot deadlock against others holding some of them
+  vector<PoolBuf> acquire(size_t n);
+  PoolBuf acquire();
+  // a buffer if one is available right away, an empty PoolBuf otherwise
+  PoolBuf try_acquire();
+  void release(char *buf);
+  PoolBuf take(); // with mtx held and a buffer available
+};
+
 vector<string> split(const string &str, char delimiter);
 vector<string> read_n_file_lines(string file_path, size_t n);
 PortAddress parse_port_address(string port_address);
+// dials every address at once with non-blocking connects; returns one socket per address, -1 where the connect
+// failed or did not finish within timeout_ms. With first_only the other attempts are abandoned once one succeeds.
+vector<int> dial(vector<PortAddress> addrs, int timeout_ms, bool first_only);
 void listen_for_peers(PortAddress self_info, void (*handle_peer)(int sock));
+string frame_msg(string msg);
 void send_msg(int sock, string msg);
 string recv_msg(int sock);
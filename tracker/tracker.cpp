@@ -1,58 +1,117 @@
 #include "../common/utils.hpp"
+#include <algorithm>
 #include <arpa/inet.h>
 #include <csignal>
 #include <cstring>
 #include <fcntl.h>
 #include <iostream>
 #include <libgen.h>
+#include <mutex>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <set>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
 using namespace std;
 
+#define LEASE_SECS 30        // a client that sent nothing for this long is dropped from the swarms
+#define LEASE_WHEEL_SLOTS 64 // one slot per second; must be more than LEASE_SECS
+
+// A file is identified by the hash of its whole content, so the same file shared in several groups is a single swarm.
+// Permissions stay per group: a holder is only handed out to requesters that are members of a group it shares the
+// file in.
 struct File {
   size_t size;
   string hash;
-  vector<string> hashes;
-  vector<set<string>> locs;         // piece -> clients
-  unordered_map<string, string> mp; // client -> file-path
-  string get_rarest_piece_info(string curr_client_addr) {
+  vector<string> hashes;                     // empty in merkle mode
+  string root;                               // merkle root of the piece hashes; peers prove pieces against it
+  vector<set<string>> locs;                  // piece -> clients
+  unordered_map<string, string> mp;          // client -> file-path
+  unordered_map<string, set<string>> groups; // client -> groups it shares the file in
+  bool shares_in(string client, const set<string> &visible) {
+    auto it = groups.find(client);
+    if (it == groups.end()) return false;
+    for (auto &g : it->second)
+      if (visible.find(g) != visible.end()) return true;
+    return false;
+  }
+  string get_rarest_piece_info(string curr_client_addr, const set<string> &visible) {
     size_t minn = SIZE_MAX;
     string res;
-    for (size_t i = 0; i < hashes.size(); i++) {
-      if (locs[i].size() < minn and locs[i].find(curr_client_addr) == locs[i].end()) {
-        minn = locs[i].size();
+    for (size_t i = 0; i < locs.size(); i++) {
+      if (locs[i].find(curr_client_addr) != locs[i].end()) continue;
+      vector<string> holders;
+      for (auto x : locs[i])
+        if (shares_in(x, visible)) holders.push_back(x);
+      if (holders.size() < minn) {
+        minn = holders.size();
         res.clear();
         res = "Success\n";
         res += to_string(i + 1) + "\n";
-        for (auto x : locs[i]) {
+        for (auto x : holders) {
           res += x + ":" + mp[x] + "\n";
         }
       }
     }
     return res;
   }
-  void stop_share(string curr_client_addr) {
-    for (auto loc : locs)
-      if (loc.find(curr_client_addr) != loc.end()) loc.erase(curr_client_addr);
-    if (mp.find(curr_client_addr) != mp.end()) mp.erase(curr_client_addr);
+  void remove_holders(const set<string> &clients) {
+    for (auto &loc : locs)
+      for (auto &x : clients) loc.erase(x);
+    for (auto &x : clients) {
+      mp.erase(x);
+      groups.erase(x);
+    }
+  }
+  void stop_share(string curr_client_addr, string groupId) {
+    if (groups.find(curr_client_addr) == groups.end()) return;
+    groups[curr_client_addr].erase(groupId);
+    if (groups[curr_client_addr].empty()) remove_holders({curr_client_addr});
   }
   string get_file_info(string groupId, string file_name) {
     string res = "Success\n";
-    res += sprint(groupId, file_name, size, hash, hashes.size());
+    res += sprint(groupId, file_name, size, hash, locs.size());
+    if (not root.empty()) res += " " + root;
     res += "\n";
     for (auto h: hashes) res += h + "\n";
     return res;
   }
-  void update_piece_info(size_t piece, string curr_client_addr, string file_path) {
-    locs[piece].insert(curr_client_addr);
+  void add_peer(string curr_client_addr, string file_path, string groupId) {
     mp[curr_client_addr] = file_path;
+    groups[curr_client_addr].insert(groupId);
+  }
+  void update_piece_info(size_t piece, string curr_client_addr, string file_path, string groupId) {
+    locs[piece].insert(curr_client_addr);
+    add_peer(curr_client_addr, file_path, groupId);
+  }
+  // what a client holds, kept while its lease is lapsed so that it is listed again once it is heard from
+  struct Holding {
+    string path;
+    set<string> groups;
+    vector<size_t> pieces;
+  };
+  Holding holding(string client) {
+    Holding h{mp[client], groups[client], {}};
+    for (size_t i = 0; i < locs.size(); i++)
+      if (locs[i].find(client) != locs[i].end()) h.pieces.push_back(i);
+    return h;
+  }
+  void restore(string client, const Holding &h) {
+    mp[client] = h.path;
+    groups[client] = h.groups;
+    for (auto i : h.pieces) locs[i].insert(client);
+  }
+  // peers exchange piece availability among themselves; the tracker only hands out the swarm
+  string get_peers(string curr_client_addr, const set<string> &visible) {
+    string res = "Success\n";
+    for (auto x : mp)
+      if (x.first != curr_client_addr and shares_in(x.first, visible)) res += x.first + ":" + x.second + "\n";
+    return res;
   }
 };
 
@@ -60,12 +119,43 @@ struct Group {
   string owner;
   set<string> members;
   set<string> requests;
-  unordered_map<string, File> filesMap; // file-name -> File
+  unordered_map<string, string> filesMap; // file-name -> file-hash
+};
+
+// Leases on peer presence, renewed by every command a logged in client sends. The wheel has a slot per second holding
+// the clients whose lease ends in that second, so each tick only looks at one slot. A client renewed after it was
+// slotted is skipped there; it also sits in a later slot.
+struct LeaseWheel {
+  size_t now = 0;                       // seconds since the tracker started
+  unordered_map<string, size_t> expiry; // client -> second its lease ends
+  vector<set<string>> slots = vector<set<string>>(LEASE_WHEEL_SLOTS);
+  void renew(string client) {
+    expiry[client] = now + LEASE_SECS;
+    slots[(now + LEASE_SECS) % LEASE_WHEEL_SLOTS].insert(client);
+  }
+  void drop(string client) { expiry.erase(client); }
+  set<string> advance() {
+    set<string> expired;
+    set<string> &slot = slots[++now % LEASE_WHEEL_SLOTS];
+    for (auto &client : slot) {
+      auto it = expiry.find(client);
+      if (it == expiry.end() or it->second > now) continue;
+      expired.insert(client);
+      expiry.erase(it);
+    }
+    slot.clear();
+    return expired;
+  }
 };
 
 unordered_map<int, pair<string, string>> activeUsers; // sock -> username, port-adddress
 unordered_map<string, string> userIdMap;              // username -> password
 unordered_map<string, Group> groupsMap;               // group-name -> Group
+unordered_map<string, File> contents;                 // file-hash -> File
+LeaseWheel leases;
+// client -> file-hash -> what it held when its lease ran out
+unordered_map<string, unordered_map<string, File::Holding>> lapsed;
+mutex state_mtx; // guards all of the above; client threads and the lease timer share it
 
 bool is_logged_in(int sock) { return activeUsers.find(sock) != activeUsers.end(); }
 bool is_registered(string userId) { return userIdMap.find(userId) != userIdMap.end(); }
@@ -79,171 +169,246 @@ bool is_membership_requested(string userId, string groupId) {
 bool file_exists(string groupId, string filename) {
   return groupsMap[groupId].filesMap.find(filename) != groupsMap[groupId].filesMap.end();
 }
+File &get_file(string groupId, string filename) { return contents[groupsMap[groupId].filesMap[filename]]; }
+set<string> member_groups(string userId) {
+  set<string> res;
+  for (auto &group : groupsMap)
+    if (group.second.members.find(userId) != group.second.members.end()) res.insert(group.first);
+  return res;
+}
 
 void logout(int sock) {
+  string userId = activeUsers[sock].first, client = activeUsers[sock].second;
+  for (auto &group : groupsMap) {
+    if (is_member(userId, group.first)) {
+      for (auto &file : group.second.filesMap) contents[file.second].stop_share(client, group.first);
+    }
+  }
+  leases.drop(client);
+  lapsed.erase(client);
   activeUsers.erase(sock);
-  for (auto group : groupsMap) {
-    if (is_member(activeUsers[sock].first, group.first)) {
-      for (auto file : group.second.filesMap) file.second.stop_share(activeUsers[sock].second);
+}
+
+// drops the clients whose lease ran out from every swarm, so only live holders are handed out; what they held is
+// kept aside until they are heard from again or log out
+void expire_leases() {
+  while (true) {
+    sleep(1);
+    lock_guard<mutex> lock(state_mtx);
+    set<string> expired = leases.advance();
+    if (expired.empty()) continue;
+    for (auto &content : contents) {
+      for (auto &client : expired)
+        if (content.second.mp.find(client) != content.second.mp.end())
+          lapsed[client][content.first] = content.second.holding(client);
+      content.second.remove_holders(expired);
     }
+    for (auto &client : expired) log_info("Lease expired:", client);
   }
 }
 
+void renew_lease(string client) {
+  leases.renew(client);
+  auto it = lapsed.find(client);
+  if (it == lapsed.end()) return;
+  for (auto &held : it->second) contents[held.first].restore(client, held.second);
+  lapsed.erase(it);
+  log_info("Lease renewed, holdings restored:", client);
+}
+
+thread_local string reply_tag; // request id of the command being handled, echoed back so clients can multiplex
+
+// replies are built under state_mtx and sent once it is released, so a client that stops reading blocks only itself
+thread_local vector<pair<int, string>> outbox;
+
+void reply(int sock, string msg) {
+  if (msg.size() == 0) msg += " ";
+  outbox.push_back({sock, reply_tag + msg});
+}
+
 void handle_command(int sock, string s) {
-  vector<string> cmd = split(s, ' ');
+  vector<string> lines = split(s, '\n');
+  vector<string> cmd = split(lines[0], ' ');
   if (cmd.size() == 0) return;
 
   if (cmd[0] == "create_user") {
-    if (cmd.size() < 3) return send_msg(sock, "INVALID COMMAND");
-    if (is_logged_in(sock)) return send_msg(sock, "already logged in");
-    if (is_registered(cmd[1])) return send_msg(sock, "user already exists");
+    if (cmd.size() < 3) return reply(sock, "INVALID COMMAND");
+    if (is_logged_in(sock)) return reply(sock, "already logged in");
+    if (is_registered(cmd[1])) return reply(sock, "user already exists");
     userIdMap[cmd[1]] = cmd[2];
-    send_msg(sock, "user created");
+    reply(sock, "user created");
 
   } else if (cmd[0] == "login") {
-    if (cmd.size() < 4) return send_msg(sock, "INVALID COMMAND");
-    if (is_logged_in(sock)) return send_msg(sock, "already logged in");
-    if (not is_registered(cmd[1])) return send_msg(sock, "Invalid user id");
-    if (userIdMap[cmd[1]] != cmd[2]) return send_msg(sock, "Invalid password");
-    send_msg(sock, "logged in");
+    if (cmd.size() < 4) return reply(sock, "INVALID COMMAND");
+    if (is_logged_in(sock)) return reply(sock, "already logged in");
+    if (not is_registered(cmd[1])) return reply(sock, "Invalid user id");
+    if (userIdMap[cmd[1]] != cmd[2]) return reply(sock, "Invalid password");
+    reply(sock, "logged in");
     activeUsers[sock] = {cmd[1], cmd[3]};
 
   } else if (cmd[0] == "create_group") {
-    if (cmd.size() < 2) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
-    if (group_exists(cmd[1])) return send_msg(sock, "group already exists");
+    if (cmd.size() < 2) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (group_exists(cmd[1])) return reply(sock, "group already exists");
     Group g;
     g.owner = activeUsers[sock].first;
     g.members.insert(activeUsers[sock].first);
     groupsMap[cmd[1]] = g;
-    send_msg(sock, "group created");
+    reply(sock, "group created");
 
   } else if (cmd[0] == "join_group") {
-    if (cmd.size() < 2) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
-    if (not group_exists(cmd[1])) return send_msg(sock, "group does not exist");
-    if (is_member(activeUsers[sock].first, cmd[1])) return send_msg(sock, "already a member");
-    if (is_membership_requested(activeUsers[sock].first, cmd[1])) return send_msg(sock, "already requested");
+    if (cmd.size() < 2) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exist");
+    if (is_member(activeUsers[sock].first, cmd[1])) return reply(sock, "already a member");
+    if (is_membership_requested(activeUsers[sock].first, cmd[1])) return reply(sock, "already requested");
     groupsMap[cmd[1]].requests.insert(activeUsers[sock].first);
-    send_msg(sock, "request sent");
+    reply(sock, "request sent");
 
   } else if (cmd[0] == "leave_group") {
-    if (cmd.size() < 2) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
-    if (not group_exists(cmd[1])) return send_msg(sock, "group does not exist");
-    if (not is_member(activeUsers[sock].first, cmd[1])) return send_msg(sock, "not a member");
+    if (cmd.size() < 2) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exist");
+    if (not is_member(activeUsers[sock].first, cmd[1])) return reply(sock, "not a member");
     groupsMap[cmd[1]].members.erase(activeUsers[sock].first);
     if (groupsMap[cmd[1]].owner == activeUsers[sock].first)
       groupsMap[cmd[1]].owner = *groupsMap[cmd[1]].members.begin(); // owner left; change owner
     if (groupsMap[cmd[1]].members.size() == 0) {
-      send_msg(sock, "last member. deleting group");
+      reply(sock, "last member. deleting group");
       groupsMap.erase(cmd[1]);
     }
 
   } else if (cmd[0] == "list_requests") {
-    if (cmd.size() < 2) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
-    if (not group_exists(cmd[1])) return send_msg(sock, "group does not exist");
-    if (groupsMap[cmd[1]].owner != activeUsers[sock].first) return send_msg(sock, "unauthorized");
+    if (cmd.size() < 2) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exist");
+    if (groupsMap[cmd[1]].owner != activeUsers[sock].first) return reply(sock, "unauthorized");
     string resp;
     for (auto req : groupsMap[cmd[1]].requests) resp += "\n" + req;
-    send_msg(sock, resp);
+    reply(sock, resp);
 
   } else if (cmd[0] == "accept_request") {
-    if (cmd.size() < 3) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
-    if (not group_exists(cmd[1])) return send_msg(sock, "group does not exist");
-    if (groupsMap[cmd[1]].owner != activeUsers[sock].first) return send_msg(sock, "unauthorized");
-    if (not is_registered(cmd[2])) return send_msg(sock, "user does not exist");
-    if (not is_membership_requested(cmd[2], cmd[1])) return send_msg(sock, "not requested");
+    if (cmd.size() < 3) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exist");
+    if (groupsMap[cmd[1]].owner != activeUsers[sock].first) return reply(sock, "unauthorized");
+    if (not is_registered(cmd[2])) return reply(sock, "user does not exist");
+    if (not is_membership_requested(cmd[2], cmd[1])) return reply(sock, "not requested");
     groupsMap[cmd[1]].requests.erase(cmd[2]);
     groupsMap[cmd[1]].members.insert(cmd[2]);
-    send_msg(sock, "request accepted");
+    reply(sock, "request accepted");
 
   } else if (cmd[0] == "list_groups") {
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
     string resp;
     for (auto group : groupsMap) resp += "\n" + group.first + "\t" + group.second.owner;
-    send_msg(sock, resp);
+    reply(sock, resp);
 
-  } else if (cmd[0] == "upload_file") { // filePath GrpId fileHash fileSize chunkCount
+  } else if (cmd[0] == "upload_file") { // filePath GrpId fileHash fileSize chunkCount [merkleRoot] \n hashes...
     print("uploading...");
-    if (cmd.size() < 4) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
-    if (not group_exists(cmd[2])) return send_msg(sock, "group does not exist");
-    if (not is_member(activeUsers[sock].first, cmd[2])) return send_msg(sock, "not a member of the group");
+    if (cmd.size() < 6) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[2])) return reply(sock, "group does not exist");
+    if (not is_member(activeUsers[sock].first, cmd[2])) return reply(sock, "not a member of the group");
     string file_path = cmd[1];
     string file_name = string(basename(cmd[1].data()));
-    if (file_exists(cmd[2], file_name)) return send_msg(sock, "file with same name already exists");
-    size_t count = strtoul(cmd[5].c_str(), nullptr, 10);
-    if (count == 0) return send_msg(sock, "invalid argument");
-    File f;
-    f.hash = cmd[3];
-    f.size = strtoul(cmd[4].c_str(), nullptr, 10);
-    f.hashes.reserve(count);
-    f.locs.resize(count, set<string>{activeUsers[sock].second});
-    f.mp[activeUsers[sock].second] = file_path;
-    send_msg(sock, "Success");
-    while (count--) {
-      print("reading hash", count);
-      string hash = recv_msg(sock);
-      if (hash == "") return;
-      f.hashes.push_back(hash);
+    if (file_exists(cmd[2], file_name)) return reply(sock, "file with same name already exists");
+    string file_hash = cmd[3];
+    if (contents.find(file_hash) == contents.end()) {
+      size_t count = strtoul(cmd[5].c_str(), nullptr, 10);
+      if (count == 0) return reply(sock, "invalid argument");
+      bool merkle = cmd.size() > 6;
+      // not known yet; client resends with hashes
+      if (not merkle and lines.size() < count + 1) return reply(sock, "send hashes");
+      File f;
+      f.hash = file_hash;
+      f.size = strtoul(cmd[4].c_str(), nullptr, 10);
+      f.locs.resize(count);
+      if (merkle) f.root = cmd[6];
+      else f.hashes.assign(lines.begin() + 1, lines.begin() + 1 + (long)count);
+      contents[file_hash] = f;
     }
-    groupsMap[cmd[2]].filesMap[file_name] = f;
-    send_msg(sock, "file uploaded");
+    File &f = contents[file_hash];
+    for (auto &loc : f.locs) loc.insert(activeUsers[sock].second);
+    f.add_peer(activeUsers[sock].second, file_path, cmd[2]);
+    groupsMap[cmd[2]].filesMap[file_name] = file_hash;
+    // the content keeps the mode it was first uploaded in; the root tells the client which one that is
+    reply(sock, f.root.empty() ? "file uploaded" : "file uploaded " + f.root);
 
   } else if (cmd[0] == "list_files") {
-    if (cmd.size() < 2) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
-    if (not group_exists(cmd[1])) return send_msg(sock, "group does not exit");
-    if (not is_member(activeUsers[sock].first, cmd[1])) return send_msg(sock, "not a member of the group");
+    if (cmd.size() < 2) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exit");
+    if (not is_member(activeUsers[sock].first, cmd[1])) return reply(sock, "not a member of the group");
     string response;
-    for (auto f : groupsMap[cmd[1]].filesMap) response += f.first + "\t" + to_string(f.second.size) + "\n";
-    send_msg(sock, response);
+    for (auto f : groupsMap[cmd[1]].filesMap) response += f.first + "\t" + to_string(contents[f.second].size) + "\n";
+    reply(sock, response);
 
   } else if (cmd[0] == "stop_share") {
-    if (cmd.size() < 3) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "not logged in");
-    if (not group_exists(cmd[1])) return send_msg(sock, "group does not exist");
-    if (not file_exists(cmd[1], cmd[2])) return send_msg(sock, "file does not exist");
-    groupsMap[cmd[1]].filesMap[cmd[2]].stop_share(activeUsers[sock].second);
-    send_msg(sock, "stopped sharing");
+    if (cmd.size() < 3) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "not logged in");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exist");
+    if (not file_exists(cmd[1], cmd[2])) return reply(sock, "file does not exist");
+    get_file(cmd[1], cmd[2]).stop_share(activeUsers[sock].second, cmd[1]);
+    reply(sock, "stopped sharing");
+
+  } else if (cmd[0] == "heartbeat") { // renews the lease, as any other command does
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    reply(sock, "alive");
 
   } else if (cmd[0] == "logout") {
-    if (not is_logged_in(sock)) return send_msg(sock, "not logged in");
+    if (not is_logged_in(sock)) return reply(sock, "not logged in");
     logout(sock);
-    send_msg(sock, "logged out");
+    reply(sock, "logged out");
 
   } else if (cmd[0] == "download_file") {
-    if (cmd.size() < 3) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
-    if (not group_exists(cmd[1])) return send_msg(sock, "group does not exist");
-    if (not file_exists(cmd[1], cmd[2])) return send_msg(sock, "file does not exist");
-    string response = groupsMap[cmd[1]].filesMap[cmd[2]].get_file_info(cmd[1], cmd[2]);
-    send_msg(sock, response);
+    if (cmd.size() < 3) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exist");
+    if (not file_exists(cmd[1], cmd[2])) return reply(sock, "file does not exist");
+    string response = get_file(cmd[1], cmd[2]).get_file_info(cmd[1], cmd[2]);
+    reply(sock, response);
 
   } else if (cmd[0] == "get_rarest_piece_info") {
-    if (cmd.size() < 3) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
-    if (not group_exists(cmd[1])) return send_msg(sock, "group does not exist");
-    if (not is_member(activeUsers[sock].first, cmd[1])) return send_msg(sock, "not a member of the group");
-    if (not file_exists(cmd[1], cmd[2])) return send_msg(sock, "file does not exist");
-    string rare_piece_info = groupsMap[cmd[1]].filesMap[cmd[2]].get_rarest_piece_info(activeUsers[sock].second);
-    send_msg(sock, rare_piece_info);
+    if (cmd.size() < 3) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exist");
+    if (not is_member(activeUsers[sock].first, cmd[1])) return reply(sock, "not a member of the group");
+    if (not file_exists(cmd[1], cmd[2])) return reply(sock, "file does not exist");
+    string rare_piece_info = get_file(cmd[1], cmd[2]).get_rarest_piece_info(activeUsers[sock].second,
+                                                                           member_groups(activeUsers[sock].first));
+    reply(sock, rare_piece_info);
+
+  } else if (cmd[0] == "get_peers") {
+    if (cmd.size() < 3) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exist");
+    if (not is_member(activeUsers[sock].first, cmd[1])) return reply(sock, "not a member of the group");
+    if (not file_exists(cmd[1], cmd[2])) return reply(sock, "file does not exist");
+    reply(sock, get_file(cmd[1], cmd[2]).get_peers(activeUsers[sock].second, member_groups(activeUsers[sock].first)));
+
+  } else if (cmd[0] == "add_peer") { // grpId filename file-path
+    if (cmd.size() < 4) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exist");
+    if (not is_member(activeUsers[sock].first, cmd[1])) return reply(sock, "not a member of the group");
+    if (not file_exists(cmd[1], cmd[2])) return reply(sock, "file does not exist");
+    get_file(cmd[1], cmd[2]).add_peer(activeUsers[sock].second, cmd[3], cmd[1]);
+    reply(sock, "added");
 
   } else if (cmd[0] == "update_piece_info") {  // grpId filename file-path piece
-    if (cmd.size() < 5) return send_msg(sock, "INVALID COMMAND");
-    if (not is_logged_in(sock)) return send_msg(sock, "login first");
-    if (not group_exists(cmd[1])) return send_msg(sock, "group does not exist");
-    if (not file_exists(cmd[1], cmd[2])) return send_msg(sock, "file does not exist");
+    if (cmd.size() < 5) return reply(sock, "INVALID COMMAND");
+    if (not is_logged_in(sock)) return reply(sock, "login first");
+    if (not group_exists(cmd[1])) return reply(sock, "group does not exist");
+    if (not file_exists(cmd[1], cmd[2])) return reply(sock, "file does not exist");
     size_t piece = strtoul(cmd[4].c_str(), nullptr, 10);
-    if (piece == 0) return send_msg(sock, "INVALID INPUT; peice number should be positive");
-    groupsMap[cmd[1]].filesMap[cmd[2]].update_piece_info(piece, activeUsers[sock].second, cmd[3]);
-    send_msg(sock, "updated");
+    if (piece == 0) return reply(sock, "INVALID INPUT; peice number should be positive");
+    if (piece > get_file(cmd[1], cmd[2]).locs.size()) return reply(sock, "INVALID INPUT; no such piece");
+    get_file(cmd[1], cmd[2]).update_piece_info(piece - 1, activeUsers[sock].second, cmd[3], cmd[1]);
+    reply(sock, "updated");
 
   } else {
-    send_msg(sock, "unknown command: " + cmd[0]);
+    reply(sock, "unknown command: " + cmd[0]);
   }
 }
 
@@ -252,18 +417,29 @@ void handle_client(int sock) {
 
   while (true) {
     string msg = recv_msg(sock);
-    if (msg == "") {
-      close(sock);
-      return;
-    }
-    if (msg == "quit") {
+    if (msg == "" or msg == "quit") {
       log_info("Client disconnected:", sock);
+      lock_guard<mutex> lock(state_mtx);
       if (is_logged_in(sock)) logout(sock);
       close(sock);
       return;
     }
-    log_info("Client", sock, msg);
-    handle_command(sock, msg);
+    reply_tag.clear();
+    if (msg[0] == '#') { // tagged request: "#<id> <command>"
+      size_t tag_end = min(msg.find(' '), msg.size());
+      reply_tag = msg.substr(0, tag_end) + " ";
+      msg = msg.substr(min(tag_end + 1, msg.size()));
+    }
+    if (msg != "heartbeat") log_info("Client", sock, msg);
+    {
+      lock_guard<mutex> lock(state_mtx);
+      bool logged_in = is_logged_in(sock);
+      if (logged_in) renew_lease(activeUsers[sock].second); // before the command, so it sees any restored holdings
+      handle_command(sock, msg);
+      if (not logged_in and is_logged_in(sock)) renew_lease(activeUsers[sock].second);
+    }
+    for (auto &x : outbox) send_msg(x.first, x.second);
+    outbox.clear();
   }
   close(sock);
 }
@@ -281,6 +457,7 @@ int main(int argc, char *argv[]) {
   if (tracker_count <= 0 or tracker_count > TRACKERS) panic("invalid tracker number");
   PortAddress tracker_info = parse_port_address(read_n_file_lines(string(argv[1]), TRACKERS)[tracker_count - 1]);
 
+  thread(expire_leases).detach();
   // int server_sock;
   listen_for_peers(tracker_info, handle_client);
 